@@ -0,0 +1,43 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+
+typedef enum {
+    PROTOCOL_OLLAMA,
+    PROTOCOL_OPENAI
+} Protocol;
+
+typedef enum {
+    BALANCE_LEAST_OUTSTANDING,
+    BALANCE_LATENCY
+} BalanceStrategy;
+
+typedef struct {
+    char *model;
+    char *url;
+    char *health_url;
+    char *api_key_env;
+    Protocol protocol;
+    int max_concurrent;
+    int timeout;
+} Backend;
+
+typedef struct {
+    Backend *backends;
+    int count;
+    BalanceStrategy strategy;
+} BackendRegistry;
+
+typedef struct {
+    const Backend *backend;
+    long request_id;
+    long started_ms;
+} BackendLease;
+
+BackendRegistry *load_backend_registry();
+void free_backend_registry(BackendRegistry *registry);
+int acquire_backend(const BackendRegistry *registry, const char *model, const char *excluded, BackendLease *lease);
+void release_backend(BackendLease *lease, int success);
+void cancel_backend(BackendLease *lease);
+int backend_interrupted();
+
+#endif
@@ -12,6 +12,7 @@ typedef struct {
     char *shortcut_command;
     int history;
     int agent_mode;
+    int timeout;
 } Options;
 
 void run_cbot(int argc, char **argv);
@@ -3,13 +3,28 @@
 
 #include <sqlite3.h>
 
+typedef struct {
+    int outstanding;
+    double latency_ms;
+    int failures;
+    long last_failure;
+} BackendStats;
+
 void initDB();
 void closeDB();
 char *checkQ(const char *question_text);
 void insertQ(const char *question_text, const char *answer_text);
+void updateExitStatus(const char *question_text, int exit_status);
 char **fetch_previous_prompts();
 char **load_agent_memory();
 void save_agent_memory_item(const char *memory_item);
 void clear_agent_memory();
+int lockBackends();
+int unlockBackends();
+BackendStats fetchBackendStats(const char *url);
+long startBackendRequest(const char *url);
+void abandonBackendRequest(long request_id);
+void finishBackendRequest(long request_id, const char *url, double latency_ms, int success);
+void recordBackendHealth(const char *url, int healthy);
 
 #endif
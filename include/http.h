@@ -6,6 +6,7 @@ typedef struct {
     int success;
 } ApiResponse;
 
+int check_health(const char *url);
 ApiResponse call_model(const char *prompt, const char *system_message, const char *model);
 
 #endif
@@ -0,0 +1,13 @@
+#ifndef PROCESS_H
+#define PROCESS_H
+
+typedef struct {
+    int exit_status;
+    int timed_out;
+    int success;
+} ProcessResult;
+
+int spawn_with_input(const char *file, char *const argv[], const char *input);
+ProcessResult run_command(const char *command, int timeout_seconds);
+
+#endif
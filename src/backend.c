@@ -0,0 +1,343 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <jansson.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "backend.h"
+#include "db.h"
+#include "http.h"
+
+#define FAILURE_COOLDOWN_SECONDS 30
+#define MAX_COOLDOWN_SECONDS 300
+#define SLOT_WAIT_MS 200
+#define MAX_SLOT_WAIT_SECONDS 120
+
+static volatile sig_atomic_t interrupted = 0;
+static struct sigaction previous_sigint, previous_sigterm;
+
+static long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static void handle_interrupt(int sig) {
+    interrupted = sig;
+}
+
+// While a slot is held, Ctrl-C only flags the request so it can be aborted and its slot released
+// Signals cbot was started ignoring (e.g. SIGINT for a background job) stay ignored.
+static void hold_signals() {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_interrupt;
+    sigemptyset(&action.sa_mask);
+
+    sigaction(SIGINT, NULL, &previous_sigint);
+    if (previous_sigint.sa_handler != SIG_IGN) {
+        sigaction(SIGINT, &action, NULL);
+    }
+    sigaction(SIGTERM, NULL, &previous_sigterm);
+    if (previous_sigterm.sa_handler != SIG_IGN) {
+        sigaction(SIGTERM, &action, NULL);
+    }
+}
+
+static char *optional_string(json_t *object, const char *key) {
+    const char *value = json_string_value(json_object_get(object, key));
+    return value ? strdup(value) : NULL;
+}
+
+static void add_backend(BackendRegistry *registry, const char *model, const char *url, Protocol protocol, const char *api_key_env) {
+    registry->backends = realloc(registry->backends, (registry->count + 1) * sizeof(Backend));
+    Backend *backend = &registry->backends[registry->count++];
+    backend->model = strdup(model);
+    backend->url = strdup(url);
+    backend->health_url = NULL;
+    backend->api_key_env = api_key_env ? strdup(api_key_env) : NULL;
+    backend->protocol = protocol;
+    backend->max_concurrent = 0;
+    backend->timeout = 0;
+}
+
+static void add_default_backends(BackendRegistry *registry) {
+    add_backend(registry, "openai-o4-mini", "https://api.openai.com/v1/chat/completions", PROTOCOL_OPENAI, "OPENAI_API_KEY");
+    add_backend(registry, "*", "http://localhost:11434/api/generate", PROTOCOL_OLLAMA, NULL);
+}
+
+static void parse_backends(BackendRegistry *registry, json_t *root, const char *path) {
+    const char *strategy = json_string_value(json_object_get(root, "strategy"));
+    if (strategy && strcmp(strategy, "latency") == 0) {
+        registry->strategy = BALANCE_LATENCY;
+    } else if (strategy && strcmp(strategy, "least_outstanding") != 0) {
+        fprintf(stderr, "%s: unknown strategy '%s', using least_outstanding\n", path, strategy);
+    }
+
+    json_t *backends = json_object_get(root, "backends");
+    if (!json_is_array(backends)) {
+        fprintf(stderr, "%s: expected a \"backends\" array\n", path);
+        return;
+    }
+
+    for (size_t i = 0; i < json_array_size(backends); i++) {
+        json_t *entry = json_array_get(backends, i);
+        const char *model = json_string_value(json_object_get(entry, "model"));
+        const char *url = json_string_value(json_object_get(entry, "url"));
+        const char *protocol = json_string_value(json_object_get(entry, "protocol"));
+        if (!model || !url) {
+            fprintf(stderr, "%s: backend %zu needs a \"model\" and a \"url\"\n", path, i);
+            continue;
+        }
+
+        Protocol parsed_protocol = PROTOCOL_OLLAMA;
+        if (protocol && strcmp(protocol, "openai") == 0) {
+            parsed_protocol = PROTOCOL_OPENAI;
+        } else if (protocol && strcmp(protocol, "ollama") != 0) {
+            fprintf(stderr, "%s: backend %zu has unknown protocol '%s'\n", path, i, protocol);
+            continue;
+        }
+
+        add_backend(registry, model, url, parsed_protocol, NULL);
+        Backend *backend = &registry->backends[registry->count - 1];
+        backend->health_url = optional_string(entry, "health_url");
+        backend->api_key_env = optional_string(entry, "api_key_env");
+        backend->max_concurrent = (int)json_integer_value(json_object_get(entry, "max_concurrent"));
+        backend->timeout = (int)json_integer_value(json_object_get(entry, "timeout"));
+    }
+}
+
+BackendRegistry *load_backend_registry() {
+    BackendRegistry *registry = malloc(sizeof(BackendRegistry));
+    registry->backends = NULL;
+    registry->count = 0;
+    registry->strategy = BALANCE_LEAST_OUTSTANDING;
+
+    char path[256];
+    char *override = getenv("CBOT_BACKENDS");
+    if (override) {
+        snprintf(path, sizeof(path), "%s", override);
+    } else {
+        snprintf(path, sizeof(path), "%s/.cbot_backends.json", getenv("HOME"));
+    }
+
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        if (override) {
+            fprintf(stderr, "Can't open backend config %s, using defaults\n", path);
+        }
+        add_default_backends(registry);
+        return registry;
+    }
+
+    json_error_t error;
+    json_t *root = json_loadf(file, 0, &error);
+    fclose(file);
+
+    if (!root) {
+        fprintf(stderr, "%s:%d: %s\n", path, error.line, error.text);
+    } else {
+        parse_backends(registry, root, path);
+        json_decref(root);
+    }
+
+    if (registry->count == 0) {
+        fprintf(stderr, "No usable backends in %s, using defaults\n", path);
+        add_default_backends(registry);
+    }
+    return registry;
+}
+
+void free_backend_registry(BackendRegistry *registry) {
+    for (int i = 0; i < registry->count; i++) {
+        free(registry->backends[i].model);
+        free(registry->backends[i].url);
+        free(registry->backends[i].health_url);
+        free(registry->backends[i].api_key_env);
+    }
+    free(registry->backends);
+    free(registry);
+}
+
+// A backend that failed recently sits out a cooldown that grows with each consecutive failure.
+// Once it expires, the health URL is probed if one is configured; otherwise the next real request is the probe.
+static int backend_is_healthy(const Backend *backend) {
+    BackendStats stats = fetchBackendStats(backend->url);
+    if (stats.failures == 0) {
+        return 1;
+    }
+
+    long cooldown = (long)FAILURE_COOLDOWN_SECONDS * stats.failures;
+    if (cooldown > MAX_COOLDOWN_SECONDS) {
+        cooldown = MAX_COOLDOWN_SECONDS;
+    }
+    if (time(NULL) - stats.last_failure < cooldown) {
+        return 0;
+    }
+    if (!backend->health_url) {
+        return 1;
+    }
+
+    int healthy = check_health(backend->health_url);
+    recordBackendHealth(backend->url, healthy);
+    return healthy;
+}
+
+int acquire_backend(const BackendRegistry *registry, const char *model, const char *excluded, BackendLease *lease) {
+    // Exact model entries win; "*" entries only serve models with no entry of their own
+    const char *match = "*";
+    for (int i = 0; i < registry->count; i++) {
+        if (strcmp(registry->backends[i].model, model) == 0) {
+            match = model;
+            break;
+        }
+    }
+
+    int configured = 0;
+    for (int i = 0; i < registry->count; i++) {
+        configured += strcmp(registry->backends[i].model, match) == 0;
+    }
+    if (configured == 0) {
+        fprintf(stderr, "No backend configured for model %s\n", model);
+        return 0;
+    }
+
+    int *candidates = malloc(registry->count * sizeof(int));
+    int candidate_count = 0;
+    int healthy_count = 0;
+    char *healthy = calloc(registry->count, 1);
+
+    for (int i = 0; i < registry->count; i++) {
+        if (excluded[i] || strcmp(registry->backends[i].model, match) != 0) {
+            continue;
+        }
+        candidates[candidate_count++] = i;
+        healthy[i] = backend_is_healthy(&registry->backends[i]);
+        healthy_count += healthy[i];
+    }
+
+    // With every backend marked down, trying one beats failing outright
+    if (healthy_count == 0) {
+        for (int c = 0; c < candidate_count; c++) {
+            healthy[candidates[c]] = 1;
+        }
+    }
+
+    BackendStats *stats = malloc(registry->count * sizeof(BackendStats));
+    long wait_deadline = now_ms() + MAX_SLOT_WAIT_SECONDS * 1000L;
+    int waiting = 0;
+    int chosen = -1;
+    while (candidate_count > 0 && chosen < 0) {
+        double best_score = 0;
+        double latency_total = 0;
+        int latency_count = 0;
+
+        // The busy timeout has already waited on the lock; keep retrying until the slot wait runs out
+        if (!lockBackends()) {
+            if (now_ms() >= wait_deadline) {
+                fprintf(stderr, "Gave up after %d seconds waiting for the backend state lock\n", MAX_SLOT_WAIT_SECONDS);
+                break;
+            }
+            struct timespec pause = { .tv_sec = 0, .tv_nsec = SLOT_WAIT_MS * 1000000L };
+            nanosleep(&pause, NULL);
+            continue;
+        }
+
+        for (int c = 0; c < candidate_count; c++) {
+            stats[candidates[c]] = fetchBackendStats(registry->backends[candidates[c]].url);
+            if (healthy[candidates[c]] && stats[candidates[c]].latency_ms >= 0) {
+                latency_total += stats[candidates[c]].latency_ms;
+                latency_count++;
+            }
+        }
+
+        // Endpoints that have never answered are scored at the mean latency, neither favoured nor starved
+        double unknown_latency = latency_count > 0 ? latency_total / latency_count : 1;
+
+        for (int c = 0; c < candidate_count; c++) {
+            const Backend *backend = &registry->backends[candidates[c]];
+            const BackendStats *backend_stats = &stats[candidates[c]];
+            if (!healthy[candidates[c]]) {
+                continue;
+            }
+            if (backend->max_concurrent > 0 && backend_stats->outstanding >= backend->max_concurrent) {
+                continue;
+            }
+
+            double score = backend_stats->outstanding;
+            if (registry->strategy == BALANCE_LATENCY) {
+                double latency_ms = backend_stats->latency_ms >= 0 ? backend_stats->latency_ms : unknown_latency;
+                score = (backend_stats->outstanding + 1) * latency_ms;
+            }
+            if (chosen < 0 || score < best_score) {
+                chosen = candidates[c];
+                best_score = score;
+            }
+        }
+
+        if (chosen >= 0) {
+            lease->backend = &registry->backends[chosen];
+            lease->request_id = startBackendRequest(lease->backend->url);
+            lease->started_ms = now_ms();
+        }
+        if (!unlockBackends()) {
+            // The reservation was rolled back with the transaction, so pick again
+            chosen = -1;
+            continue;
+        }
+        if (chosen >= 0) {
+            hold_signals();
+        }
+
+        if (chosen < 0) {
+            if (now_ms() >= wait_deadline) {
+                fprintf(stderr, "Gave up after %d seconds waiting for a free backend for %s\n", MAX_SLOT_WAIT_SECONDS, model);
+                break;
+            }
+            if (!waiting) {
+                fprintf(stderr, "All backends for %s are busy, waiting for a free slot...\n", model);
+                waiting = 1;
+            }
+            struct timespec pause = { .tv_sec = 0, .tv_nsec = SLOT_WAIT_MS * 1000000L };
+            nanosleep(&pause, NULL);
+        }
+    }
+
+    free(candidates);
+    free(healthy);
+    free(stats);
+    return chosen >= 0;
+}
+
+static void end_lease(BackendLease *lease, int record, int success) {
+    if (record && !interrupted) {
+        double latency_ms = (double)(now_ms() - lease->started_ms);
+        finishBackendRequest(lease->request_id, lease->backend->url, latency_ms, success);
+    } else {
+        abandonBackendRequest(lease->request_id);
+    }
+    lease->backend = NULL;
+
+    // The slot is released, so an interrupt held during the request can now take its usual effect
+    sigaction(SIGINT, &previous_sigint, NULL);
+    sigaction(SIGTERM, &previous_sigterm, NULL);
+    if (interrupted) {
+        int sig = interrupted;
+        interrupted = 0;
+        raise(sig);
+    }
+}
+
+void release_backend(BackendLease *lease, int success) {
+    end_lease(lease, 1, success);
+}
+
+void cancel_backend(BackendLease *lease) {
+    end_lease(lease, 0, 0);
+}
+
+int backend_interrupted() {
+    return interrupted != 0;
+}
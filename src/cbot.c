@@ -1,4 +1,5 @@
 #include <jansson.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,6 +7,11 @@
 #include "cbot.h"
 #include "db.h"
 #include "http.h"
+#include "process.h"
+
+static void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-l 32] [-d] [-o a] [-a] [-x] [-t seconds] [-c] [-g] [-s] [-m] [-h] <question>\n", program);
+}
 
 Options *parse_options(int argc, char **argv) {
     Options *options = malloc(sizeof(Options));
@@ -16,9 +22,10 @@ Options *parse_options(int argc, char **argv) {
     options->shortcut = 0;
     options->history = 0;
     options->agent_mode = 0;
+    options->timeout = 0;
 
     int opt;
-    while ((opt = getopt(argc, argv, "l:do:s:axcgmh")) != -1) {
+    while ((opt = getopt(argc, argv, "l:do:s:t:axcgmh")) != -1) {
         switch (opt) {
             case 'l':
                 if (strcmp(optarg, "32") == 0) {
@@ -39,6 +46,17 @@ Options *parse_options(int argc, char **argv) {
             case 'x':
                 options->execute = 1;
                 break;
+            case 't': {
+                char *end;
+                long timeout = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || timeout <= 0 || timeout > INT_MAX) {
+                    fprintf(stderr, "-t requires a positive number of seconds\n");
+                    print_usage(argv[0]);
+                    exit(1);
+                }
+                options->timeout = (int)timeout;
+                break;
+            }
             case 'c':
                 options->clip = 1;
                 break;
@@ -66,55 +84,77 @@ Options *parse_options(int argc, char **argv) {
                 printf("cbot \"How do I put my computer to sleep\"\n");
                 printf("cbot -c \"how do I install homebrew?\"      (copies the result to clipboard)\n");
                 printf("cbot -x what is the date                  (executes the result)\n");
+                printf("cbot -x -t 10 list large files            (executes the result, killed after 10 seconds)\n");
                 printf("cbot -g who was the 22nd president        (runs in general question mode)\n");
                 printf("cbot -m                                   (prints the converstaion history)\n");
                 printf("cbot -a                                   (runs in agent mode)\n");
                 exit(0);
             default:
-                fprintf(stderr, "Usage: %s [-l 32] [-d] [-o a] [-a] [-x] [-c] [-g] [-s] [-m] [-h] <question>\n", argv[0]);
+                print_usage(argv[0]);
                 exit(1);
         }
     }
 
+    if (options->timeout && !options->execute) {
+        fprintf(stderr, "-t only applies to commands run with -x\n");
+        print_usage(argv[0]);
+        exit(1);
+    }
+
     return options;
 }
 
 void copy_to_clipboard(const char *text) {
-    char command[1024];
 #if __APPLE__
-    snprintf(command, sizeof(command), "echo \"%s\" | pbcopy", text);
+    char *argv[] = { "pbcopy", NULL };
+    spawn_with_input("pbcopy", argv, text);
 #elif __linux__
-    snprintf(command, sizeof(command), "echo \"%s\" | xclip -selection clipboard", text);
+    char *argv[] = { "xclip", "-selection", "clipboard", NULL };
+    spawn_with_input("xclip", argv, text);
 #elif _WIN32
-    snprintf(command, sizeof(command), "echo %s | clip", text);
+    FILE *clip = _popen("clip", "w");
+    if (clip) {
+        fputs(text, clip);
+        _pclose(clip);
+    }
 #endif
-    system(command);
 }
 
-void execute_command(const char *command) {
+int execute_command(const char *command, int timeout_seconds) {
+    char *extracted_command = NULL;
     char *start = strchr(command, '`');
     if (start) {
         char *end = strchr(start + 1, '`');
-        if (end) {
-            char extracted_command[1024];
-            snprintf(extracted_command, end - start, "%s", start + 1);
-            if (strstr(extracted_command, "sudo") != NULL) {
-                printf("Execution canceled, cbot will not execute sudo commands.\n");
-            } else {
-                printf("cbot executing: %s\n", extracted_command);
-                system(extracted_command);
-            }
-        } else {
+        if (!end) {
             printf("Could not find closing backtick in command.\n");
+            return -1;
         }
+        size_t len = end - start - 1;
+        extracted_command = malloc(len + 1);
+        memcpy(extracted_command, start + 1, len);
+        extracted_command[len] = '\0';
+        command = extracted_command;
+    }
+
+    int exit_status = -1;
+    if (strstr(command, "sudo") != NULL) {
+        printf("Execution canceled, cbot will not execute sudo commands.\n");
     } else {
-        if (strstr(command, "sudo") != NULL) {
-            printf("Execution canceled, cbot will not execute sudo commands.\n");
-        } else {
-            printf("cbot executing: %s\n", command);
-            system(command);
+        printf("cbot executing: %s\n", command);
+        ProcessResult result = run_command(command, timeout_seconds);
+        if (result.timed_out) {
+            // The 137 from the kill says nothing about the command itself, so it isn't reported or cached
+            printf("cbot: command timed out after %d seconds\n", timeout_seconds);
+        } else if (result.success) {
+            exit_status = result.exit_status;
+            if (exit_status != 0) {
+                printf("cbot: command exited with status %d\n", exit_status);
+            }
         }
     }
+
+    free(extracted_command);
+    return exit_status;
 }
 
 void run_cbot(int argc, char **argv) {
@@ -211,7 +251,10 @@ void run_cbot(int argc, char **argv) {
                 copy_to_clipboard(answer);
             }
             if (options->execute) {
-                execute_command(answer);
+                int exit_status = execute_command(answer, options->timeout);
+                if (exit_status >= 0) {
+                    updateExitStatus(question, exit_status);
+                }
             }
             free(answer);
         } else {
@@ -235,10 +278,14 @@ void run_cbot(int argc, char **argv) {
                 if (options->clip) {
                     copy_to_clipboard(api_response.response);
                 }
+                int exit_status = -1;
                 if (options->execute) {
-                    execute_command(api_response.response);
+                    exit_status = execute_command(api_response.response, options->timeout);
                 }
                 insertQ(question, api_response.response);
+                if (exit_status >= 0) {
+                    updateExitStatus(question, exit_status);
+                }
                 free(api_response.response);
             } else {
                 printf("Failed to get answer from API\n");
@@ -1,10 +1,20 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
 #include <jansson.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sqlite3.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include "db.h"
 
+// Rows from other hosts can't be checked for a live owner, so they expire after this long.
+// Rows from this host are kept for as long as their owner is alive.
+#define BACKEND_INFLIGHT_TTL 600
+
 static sqlite3 *cache;
 
 void initDB() {
@@ -17,10 +27,15 @@ void initDB() {
         return;
     }
 
+    // Several cbot processes share the backend tables, so wait out each other's locks
+    sqlite3_busy_timeout(cache, 5000);
+
     char *err_msg = 0;
     const char *sql_questions = "CREATE TABLE IF NOT EXISTS questions (id INTEGER PRIMARY KEY, question TEXT, answer TEXT, count INTEGER DEFAULT 1, timestamp DATETIME DEFAULT CURRENT_TIMESTAMP)";
     const char *sql_conversations = "CREATE TABLE IF NOT EXISTS conversations (id INTEGER PRIMARY KEY, messages TEXT, timestamp DATETIME DEFAULT CURRENT_TIMESTAMP)";
     const char *sql_agent_memory = "CREATE TABLE IF NOT EXISTS agent_memory (id INTEGER PRIMARY KEY, memory_item TEXT, timestamp DATETIME DEFAULT CURRENT_TIMESTAMP)";
+    const char *sql_backend_stats = "CREATE TABLE IF NOT EXISTS backend_stats (url TEXT PRIMARY KEY, latency_ms REAL, failures INTEGER DEFAULT 0, last_failure INTEGER DEFAULT 0)";
+    const char *sql_backend_inflight = "CREATE TABLE IF NOT EXISTS backend_inflight (id INTEGER PRIMARY KEY, url TEXT, started INTEGER, pid INTEGER, host TEXT)";
 
     if (sqlite3_exec(cache, sql_questions, 0, 0, &err_msg) != SQLITE_OK) {
         fprintf(stderr, "SQL error: %s\n", err_msg);
@@ -34,6 +49,18 @@ void initDB() {
         fprintf(stderr, "SQL error: %s\n", err_msg);
         sqlite3_free(err_msg);
     }
+    if (sqlite3_exec(cache, sql_backend_stats, 0, 0, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+    }
+    if (sqlite3_exec(cache, sql_backend_inflight, 0, 0, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+    }
+
+    // Older caches predate the exit_status column; the error on an up-to-date cache is expected
+    const char *sql_exit_status = "ALTER TABLE questions ADD COLUMN exit_status INTEGER";
+    sqlite3_exec(cache, sql_exit_status, 0, 0, 0);
 }
 
 void closeDB() {
@@ -107,6 +134,24 @@ void insertQ(const char *question_text, const char *answer_text) {
     free(messages_str);
 }
 
+void updateExitStatus(const char *question_text, int exit_status) {
+    sqlite3_stmt *stmt;
+    const char *sql = "UPDATE questions SET exit_status = ? WHERE question = ?";
+    if (sqlite3_prepare_v2(cache, sql, -1, &stmt, 0) != SQLITE_OK) {
+        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(cache));
+        return;
+    }
+
+    sqlite3_bind_int(stmt, 1, exit_status);
+    sqlite3_bind_text(stmt, 2, question_text, -1, SQLITE_STATIC);
+
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        fprintf(stderr, "Failed to update exit status: %s\n", sqlite3_errmsg(cache));
+    }
+
+    sqlite3_finalize(stmt);
+}
+
 char **fetch_previous_prompts() {
     sqlite3_stmt *stmt;
     const char *sql = "SELECT messages FROM conversations ORDER BY timestamp DESC LIMIT 10";
@@ -187,3 +232,200 @@ void clear_agent_memory() {
     }
 }
 
+int lockBackends() {
+    char *err_msg = 0;
+    if (sqlite3_exec(cache, "BEGIN IMMEDIATE", 0, 0, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        return 0;
+    }
+    return 1;
+}
+
+int unlockBackends() {
+    char *err_msg = 0;
+    if (sqlite3_exec(cache, "COMMIT", 0, 0, &err_msg) != SQLITE_OK) {
+        fprintf(stderr, "SQL error: %s\n", err_msg);
+        sqlite3_free(err_msg);
+        sqlite3_exec(cache, "ROLLBACK", 0, 0, 0);
+        return 0;
+    }
+    return 1;
+}
+
+static const char *host_name() {
+    static char host[256];
+    if (host[0] == '\0' && gethostname(host, sizeof(host) - 1) != 0) {
+        snprintf(host, sizeof(host), "localhost");
+    }
+    return host;
+}
+
+// Drop in-flight rows left by cbot processes on this host that were killed mid-request
+static void prune_dead_requests(const char *url) {
+    sqlite3_stmt *stmt;
+    const char *sql = "SELECT id, pid FROM backend_inflight WHERE url = ? AND host = ?";
+    if (sqlite3_prepare_v2(cache, sql, -1, &stmt, 0) != SQLITE_OK) {
+        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(cache));
+        return;
+    }
+
+    sqlite3_bind_text(stmt, 1, url, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, host_name(), -1, SQLITE_STATIC);
+
+    int count = 0;
+    long *dead = NULL;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        pid_t pid = (pid_t)sqlite3_column_int64(stmt, 1);
+        if (kill(pid, 0) != 0 && errno == ESRCH) {
+            dead = realloc(dead, (count + 1) * sizeof(long));
+            dead[count++] = (long)sqlite3_column_int64(stmt, 0);
+        }
+    }
+
+    sqlite3_finalize(stmt);
+
+    for (int i = 0; i < count; i++) {
+        abandonBackendRequest(dead[i]);
+    }
+    free(dead);
+}
+
+BackendStats fetchBackendStats(const char *url) {
+    BackendStats stats = { .outstanding = 0, .latency_ms = -1, .failures = 0, .last_failure = 0 };
+    prune_dead_requests(url);
+
+    sqlite3_stmt *stmt;
+    const char *sql = "SELECT COUNT(*) FROM backend_inflight WHERE url = ? AND (host = ? OR started > ?)";
+    if (sqlite3_prepare_v2(cache, sql, -1, &stmt, 0) != SQLITE_OK) {
+        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(cache));
+        return stats;
+    }
+
+    sqlite3_bind_text(stmt, 1, url, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, host_name(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 3, (sqlite3_int64)time(NULL) - BACKEND_INFLIGHT_TTL);
+
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        stats.outstanding = sqlite3_column_int(stmt, 0);
+    }
+
+    sqlite3_finalize(stmt);
+
+    sql = "SELECT latency_ms, failures, last_failure FROM backend_stats WHERE url = ?";
+    if (sqlite3_prepare_v2(cache, sql, -1, &stmt, 0) != SQLITE_OK) {
+        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(cache));
+        return stats;
+    }
+
+    sqlite3_bind_text(stmt, 1, url, -1, SQLITE_STATIC);
+
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        if (sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+            stats.latency_ms = sqlite3_column_double(stmt, 0);
+        }
+        stats.failures = sqlite3_column_int(stmt, 1);
+        stats.last_failure = (long)sqlite3_column_int64(stmt, 2);
+    }
+
+    sqlite3_finalize(stmt);
+    return stats;
+}
+
+long startBackendRequest(const char *url) {
+    sqlite3_stmt *stmt;
+    const char *sql = "INSERT INTO backend_inflight (url, started, pid, host) VALUES (?, ?, ?, ?)";
+    if (sqlite3_prepare_v2(cache, sql, -1, &stmt, 0) != SQLITE_OK) {
+        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(cache));
+        return 0;
+    }
+
+    sqlite3_bind_text(stmt, 1, url, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, (sqlite3_int64)time(NULL));
+    sqlite3_bind_int64(stmt, 3, (sqlite3_int64)getpid());
+    sqlite3_bind_text(stmt, 4, host_name(), -1, SQLITE_STATIC);
+
+    long request_id = 0;
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        fprintf(stderr, "Failed to insert backend request: %s\n", sqlite3_errmsg(cache));
+    } else {
+        request_id = (long)sqlite3_last_insert_rowid(cache);
+    }
+
+    sqlite3_finalize(stmt);
+    return request_id;
+}
+
+void abandonBackendRequest(long request_id) {
+    sqlite3_stmt *stmt;
+    const char *sql = "DELETE FROM backend_inflight WHERE id = ? OR (host != ? AND started <= ?)";
+    if (sqlite3_prepare_v2(cache, sql, -1, &stmt, 0) != SQLITE_OK) {
+        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(cache));
+        return;
+    }
+
+    sqlite3_bind_int64(stmt, 1, request_id);
+    sqlite3_bind_text(stmt, 2, host_name(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 3, (sqlite3_int64)time(NULL) - BACKEND_INFLIGHT_TTL);
+
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        fprintf(stderr, "Failed to delete backend request: %s\n", sqlite3_errmsg(cache));
+    }
+
+    sqlite3_finalize(stmt);
+}
+
+void finishBackendRequest(long request_id, const char *url, double latency_ms, int success) {
+    sqlite3_stmt *stmt;
+    abandonBackendRequest(request_id);
+
+    if (!success) {
+        recordBackendHealth(url, 0);
+        return;
+    }
+
+    // Latency is an exponential moving average so one slow answer doesn't swing the balancing
+    const char *sql = "INSERT INTO backend_stats (url, latency_ms, failures) VALUES (?, ?, 0) "
+          "ON CONFLICT(url) DO UPDATE SET failures = 0, latency_ms = "
+          "CASE WHEN latency_ms IS NULL THEN excluded.latency_ms ELSE latency_ms * 0.7 + excluded.latency_ms * 0.3 END";
+    if (sqlite3_prepare_v2(cache, sql, -1, &stmt, 0) != SQLITE_OK) {
+        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(cache));
+        return;
+    }
+
+    sqlite3_bind_text(stmt, 1, url, -1, SQLITE_STATIC);
+    sqlite3_bind_double(stmt, 2, latency_ms);
+
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        fprintf(stderr, "Failed to update backend stats: %s\n", sqlite3_errmsg(cache));
+    }
+
+    sqlite3_finalize(stmt);
+}
+
+void recordBackendHealth(const char *url, int healthy) {
+    sqlite3_stmt *stmt;
+    const char *sql;
+    if (healthy) {
+        sql = "INSERT INTO backend_stats (url, failures) VALUES (?, 0) "
+              "ON CONFLICT(url) DO UPDATE SET failures = 0";
+    } else {
+        sql = "INSERT INTO backend_stats (url, failures, last_failure) VALUES (?, 1, ?) "
+              "ON CONFLICT(url) DO UPDATE SET failures = failures + 1, last_failure = excluded.last_failure";
+    }
+    if (sqlite3_prepare_v2(cache, sql, -1, &stmt, 0) != SQLITE_OK) {
+        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(cache));
+        return;
+    }
+
+    sqlite3_bind_text(stmt, 1, url, -1, SQLITE_STATIC);
+    if (!healthy) {
+        sqlite3_bind_int64(stmt, 2, (sqlite3_int64)time(NULL));
+    }
+
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        fprintf(stderr, "Failed to update backend health: %s\n", sqlite3_errmsg(cache));
+    }
+
+    sqlite3_finalize(stmt);
+}
@@ -3,8 +3,11 @@
 #include <string.h>
 #include <curl/curl.h>
 #include <jansson.h>
+#include "backend.h"
 #include "http.h"
 
+#define CONNECT_TIMEOUT_SECONDS 5L
+
 struct MemoryStruct {
     char *memory;
     size_t size;
@@ -28,7 +31,58 @@ static size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb, voi
     return realsize;
 }
 
-ApiResponse call_openai_model(const char *prompt, const char *system_message, const char *model) {
+static size_t DiscardCallback(void *contents, size_t size, size_t nmemb, void *userp) {
+    (void)contents;
+    (void)userp;
+    return size * nmemb;
+}
+
+int check_health(const char *url) {
+    CURL *curl;
+    CURLcode res;
+    int healthy = 0;
+
+    curl_global_init(CURL_GLOBAL_ALL);
+    curl = curl_easy_init();
+
+    if (curl) {
+        curl_easy_setopt(curl, CURLOPT_URL, url);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 2L);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, DiscardCallback);
+
+        res = curl_easy_perform(curl);
+
+        long status = 0;
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+        healthy = res == CURLE_OK && status >= 200 && status < 300;
+
+        curl_easy_cleanup(curl);
+    }
+
+    curl_global_cleanup();
+    return healthy;
+}
+
+static int InterruptCallback(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+    (void)clientp;
+    (void)dltotal;
+    (void)dlnow;
+    (void)ultotal;
+    (void)ulnow;
+    return backend_interrupted();
+}
+
+// An unreachable host must fail fast for failover to the next endpoint to be useful
+static void set_backend_timeouts(CURL *curl, const Backend *backend) {
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, CONNECT_TIMEOUT_SECONDS);
+    if (backend->timeout > 0) {
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)backend->timeout);
+    }
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, InterruptCallback);
+}
+
+static ApiResponse call_openai_model(const char *prompt, const char *system_message, const char *model, const Backend *backend) {
     CURL *curl;
     CURLcode res;
     ApiResponse api_response = { .response = NULL, .success = 0 };
@@ -41,9 +95,6 @@ ApiResponse call_openai_model(const char *prompt, const char *system_message, co
     curl = curl_easy_init();
 
     if (curl) {
-        char url[256];
-        snprintf(url, sizeof(url), "https://api.openai.com/v1/chat/completions");
-
         json_t *payload_json = json_object();
         json_object_set_new(payload_json, "model", json_string(model));
         json_t *messages_array = json_array();
@@ -61,24 +112,22 @@ ApiResponse call_openai_model(const char *prompt, const char *system_message, co
 
         char *payload_str = json_dumps(payload_json, 0);
 
-        char *api_key = getenv("OPENAI_API_KEY");
-        if (!api_key) {
-            fprintf(stderr, "OPENAI_API_KEY environment variable not set\n");
-            return api_response;
-        }
-
-        char auth_header[256];
-        snprintf(auth_header, sizeof(auth_header), "Authorization: Bearer %s", api_key);
-
         struct curl_slist *headers = NULL;
         headers = curl_slist_append(headers, "Content-Type: application/json");
-        headers = curl_slist_append(headers, auth_header);
 
-        curl_easy_setopt(curl, CURLOPT_URL, url);
+        // Local OpenAI-compatible servers such as llama.cpp's don't need a key; call_model has checked it is set
+        if (backend->api_key_env) {
+            char auth_header[256];
+            snprintf(auth_header, sizeof(auth_header), "Authorization: Bearer %s", getenv(backend->api_key_env));
+            headers = curl_slist_append(headers, auth_header);
+        }
+
+        curl_easy_setopt(curl, CURLOPT_URL, backend->url);
         curl_easy_setopt(curl, CURLOPT_POSTFIELDS, payload_str);
         curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
         curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
         curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
+        set_backend_timeouts(curl, backend);
 
         res = curl_easy_perform(curl);
 
@@ -104,6 +153,7 @@ ApiResponse call_openai_model(const char *prompt, const char *system_message, co
         }
 
         curl_easy_cleanup(curl);
+        curl_slist_free_all(headers);
         free(payload_str);
         json_decref(payload_json);
         free(chunk.memory);
@@ -113,11 +163,7 @@ ApiResponse call_openai_model(const char *prompt, const char *system_message, co
     return api_response;
 }
 
-ApiResponse call_model(const char *prompt, const char *system_message, const char *model) {
-    if (strstr(model, "openai") != NULL) {
-        return call_openai_model(prompt, system_message, model);
-    }
-
+static ApiResponse call_ollama_model(const char *prompt, const char *system_message, const char *model, const Backend *backend) {
     CURL *curl;
     CURLcode res;
     ApiResponse api_response = { .response = NULL, .success = 0 };
@@ -130,9 +176,6 @@ ApiResponse call_model(const char *prompt, const char *system_message, const cha
     curl = curl_easy_init();
 
     if (curl) {
-        char url[256];
-        snprintf(url, sizeof(url), "http://localhost:11434/api/generate");
-
         json_t *payload_json = json_object();
         json_object_set_new(payload_json, "model", json_string(model));
         json_object_set_new(payload_json, "prompt", json_string(prompt));
@@ -147,11 +190,12 @@ ApiResponse call_model(const char *prompt, const char *system_message, const cha
         struct curl_slist *headers = NULL;
         headers = curl_slist_append(headers, "Content-Type: application/json");
 
-        curl_easy_setopt(curl, CURLOPT_URL, url);
+        curl_easy_setopt(curl, CURLOPT_URL, backend->url);
         curl_easy_setopt(curl, CURLOPT_POSTFIELDS, payload_str);
         curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
         curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
         curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
+        set_backend_timeouts(curl, backend);
 
         res = curl_easy_perform(curl);
 
@@ -172,6 +216,7 @@ ApiResponse call_model(const char *prompt, const char *system_message, const cha
         }
 
         curl_easy_cleanup(curl);
+        curl_slist_free_all(headers);
         free(payload_str);
         json_decref(payload_json);
         free(chunk.memory);
@@ -179,4 +224,35 @@ ApiResponse call_model(const char *prompt, const char *system_message, const cha
 
     curl_global_cleanup();
     return api_response;
-}
\ No newline at end of file
+}
+
+ApiResponse call_model(const char *prompt, const char *system_message, const char *model) {
+    ApiResponse api_response = { .response = NULL, .success = 0 };
+    BackendRegistry *registry = load_backend_registry();
+    char *excluded = calloc(registry->count, 1);
+    BackendLease lease;
+
+    // Fail over to the next backend for this model until one answers or none are left
+    while (acquire_backend(registry, model, excluded, &lease)) {
+        excluded[lease.backend - registry->backends] = 1;
+        if (lease.backend->api_key_env && !getenv(lease.backend->api_key_env)) {
+            // A local configuration problem, not a reason to put the endpoint in cooldown
+            fprintf(stderr, "%s environment variable not set\n", lease.backend->api_key_env);
+            cancel_backend(&lease);
+            continue;
+        }
+        if (lease.backend->protocol == PROTOCOL_OPENAI) {
+            api_response = call_openai_model(prompt, system_message, model, lease.backend);
+        } else {
+            api_response = call_ollama_model(prompt, system_message, model, lease.backend);
+        }
+        release_backend(&lease, api_response.success);
+        if (api_response.success) {
+            break;
+        }
+    }
+
+    free(excluded);
+    free_backend_registry(registry);
+    return api_response;
+}
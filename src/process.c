@@ -0,0 +1,324 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "process.h"
+
+// Bounds the output forwarded after the child exits, in case a background job it started keeps writing
+#define DRAIN_LIMIT (256 * 1024)
+
+extern char **environ;
+
+static int sigchld_pipe[2] = { -1, -1 };
+static volatile pid_t timed_group = 0;
+
+static void handle_sigchld(int sig) {
+    (void)sig;
+    int saved_errno = errno;
+    ssize_t ignored = write(sigchld_pipe[1], "x", 1);
+    (void)ignored;
+    errno = saved_errno;
+}
+
+static void forward_signal(int sig) {
+    if (timed_group > 0) {
+        kill(-timed_group, sig);
+    }
+}
+
+static long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static int wait_child(pid_t pid, int *status) {
+    while (waitpid(pid, status, 0) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int decode_status(int status) {
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return -1;
+}
+
+int spawn_with_input(const char *file, char *const argv[], const char *input) {
+    int in_pipe[2];
+    if (pipe(in_pipe) != 0) {
+        fprintf(stderr, "pipe() failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, in_pipe[0], STDIN_FILENO);
+    posix_spawn_file_actions_addclose(&actions, in_pipe[0]);
+    posix_spawn_file_actions_addclose(&actions, in_pipe[1]);
+
+    pid_t pid;
+    int rc = posix_spawnp(&pid, file, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(in_pipe[0]);
+
+    if (rc != 0) {
+        fprintf(stderr, "Failed to run %s: %s\n", file, strerror(rc));
+        close(in_pipe[1]);
+        return -1;
+    }
+
+    // Don't let a reader that exits early take cbot down with SIGPIPE
+    struct sigaction ignore, previous;
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore, &previous);
+
+    size_t remaining = strlen(input);
+    const char *p = input;
+    while (remaining > 0) {
+        ssize_t written = write(in_pipe[1], p, remaining);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Failed to write to %s: %s\n", file, strerror(errno));
+            break;
+        }
+        p += written;
+        remaining -= written;
+    }
+    close(in_pipe[1]);
+    sigaction(SIGPIPE, &previous, NULL);
+
+    int status;
+    if (wait_child(pid, &status) != 0) {
+        return -1;
+    }
+    return decode_status(status);
+}
+
+// Forwards one read from each pipe that poll() reported ready and returns the number of bytes forwarded
+static size_t forward_ready(struct pollfd *fds) {
+    FILE *sinks[2] = { stdout, stderr };
+    char buffer[4096];
+    size_t forwarded = 0;
+
+    for (int i = 0; i < 2; i++) {
+        if (fds[i].fd < 0 || !(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+            continue;
+        }
+        ssize_t n = read(fds[i].fd, buffer, sizeof(buffer));
+        if (n > 0) {
+            fwrite(buffer, 1, n, sinks[i]);
+            fflush(sinks[i]);
+            forwarded += n;
+        } else if (n == 0 || errno != EINTR) {
+            close(fds[i].fd);
+            fds[i].fd = -1;
+        }
+    }
+
+    return forwarded;
+}
+
+static int make_sigchld_pipe() {
+    if (pipe(sigchld_pipe) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(sigchld_pipe[i], F_SETFD, FD_CLOEXEC);
+        fcntl(sigchld_pipe[i], F_SETFL, O_NONBLOCK);
+    }
+    return 0;
+}
+
+ProcessResult run_command(const char *command, int timeout_seconds) {
+    ProcessResult result = { .exit_status = -1, .timed_out = 0, .success = 0 };
+
+    int out_pipe[2], err_pipe[2];
+    if (pipe(out_pipe) != 0) {
+        fprintf(stderr, "pipe() failed: %s\n", strerror(errno));
+        return result;
+    }
+    if (pipe(err_pipe) != 0) {
+        fprintf(stderr, "pipe() failed: %s\n", strerror(errno));
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        return result;
+    }
+    if (make_sigchld_pipe() != 0) {
+        fprintf(stderr, "pipe() failed: %s\n", strerror(errno));
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        close(err_pipe[0]);
+        close(err_pipe[1]);
+        return result;
+    }
+
+    // The SIGCHLD self-pipe wakes poll() the moment the child exits, so there is no polling interval
+    struct sigaction action, previous_sigchld, previous_sigint, previous_sigterm;
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_handler = handle_sigchld;
+    action.sa_flags = SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &action, &previous_sigchld);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, out_pipe[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, err_pipe[1], STDERR_FILENO);
+    posix_spawn_file_actions_addclose(&actions, out_pipe[0]);
+    posix_spawn_file_actions_addclose(&actions, out_pipe[1]);
+    posix_spawn_file_actions_addclose(&actions, err_pipe[0]);
+    posix_spawn_file_actions_addclose(&actions, err_pipe[1]);
+
+    // A timed command gets its own process group so the whole pipeline can be killed.
+    // Untimed commands stay in cbot's group, which already receives the terminal's signals.
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    if (timeout_seconds > 0) {
+        posix_spawnattr_setpgroup(&attr, 0);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    }
+
+    // Flush our own buffered output so it doesn't interleave with the child's
+    fflush(stdout);
+    fflush(stderr);
+
+    // Generated commands are shell syntax (pipes, builtins like cd or export), so they always go through /bin/sh
+    pid_t pid;
+    char *shell_argv[] = { "/bin/sh", "-c", (char *)command, NULL };
+    int rc = posix_spawn(&pid, "/bin/sh", &actions, &attr, shell_argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(out_pipe[1]);
+    close(err_pipe[1]);
+
+    int owns_terminal = 0;
+    if (rc == 0 && timeout_seconds > 0) {
+        // Ctrl-C and kill reach cbot rather than the command's group; pass them on
+        timed_group = pid;
+        action.sa_handler = forward_signal;
+        action.sa_flags = 0;
+        sigaction(SIGINT, &action, &previous_sigint);
+        sigaction(SIGTERM, &action, &previous_sigterm);
+
+        // Hand the terminal to the command so it can read the tty, and wake it if it already stopped trying
+        if (isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp()) {
+            owns_terminal = tcsetpgrp(STDIN_FILENO, pid) == 0;
+            kill(-pid, SIGCONT);
+        }
+    }
+
+    long deadline = timeout_seconds > 0 ? now_ms() + timeout_seconds * 1000L : 0;
+    struct pollfd fds[3] = {
+        { .fd = out_pipe[0], .events = POLLIN },
+        { .fd = err_pipe[0], .events = POLLIN },
+        { .fd = sigchld_pipe[0], .events = POLLIN },
+    };
+    int status;
+    int exited = 0;
+
+    // Stop when the child exits, not when its pipes close: background jobs it started may hold them open
+    while (rc == 0) {
+        pid_t done = waitpid(pid, &status, WNOHANG);
+        if (done == pid) {
+            exited = 1;
+            break;
+        }
+        if (done < 0 && errno != EINTR) {
+            break;
+        }
+
+        int wait_ms = -1;
+        if (deadline) {
+            long remaining = deadline - now_ms();
+            if (remaining <= 0) {
+                result.timed_out = 1;
+                break;
+            }
+            wait_ms = (int)remaining;
+        } else if (fds[0].fd < 0 && fds[1].fd < 0) {
+            // Nothing left to forward and no deadline to enforce
+            exited = wait_child(pid, &status) == 0;
+            break;
+        }
+
+        int ready = poll(fds, 3, wait_ms);
+        if (ready < 0) {
+            if (errno != EINTR) {
+                fprintf(stderr, "poll() failed: %s\n", strerror(errno));
+                break;
+            }
+            continue;
+        }
+        if (fds[2].revents & POLLIN) {
+            char drained[64];
+            while (read(sigchld_pipe[0], drained, sizeof(drained)) > 0) {
+            }
+        }
+        forward_ready(fds);
+    }
+
+    // Forward what the child wrote before exiting, but don't chase output from anything it left running
+    size_t drained_bytes = 0;
+    while (exited && drained_bytes < DRAIN_LIMIT && (fds[0].fd >= 0 || fds[1].fd >= 0) && poll(fds, 2, 0) > 0) {
+        drained_bytes += forward_ready(fds);
+    }
+
+    if (result.timed_out) {
+        kill(-pid, SIGKILL);
+        exited = wait_child(pid, &status) == 0;
+    }
+
+    if (owns_terminal) {
+        // cbot is a background group at this point, so SIGTTOU must not stop it while it takes the terminal back
+        sigset_t ttou, previous_mask;
+        sigemptyset(&ttou);
+        sigaddset(&ttou, SIGTTOU);
+        sigprocmask(SIG_BLOCK, &ttou, &previous_mask);
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+        sigprocmask(SIG_SETMASK, &previous_mask, NULL);
+    }
+    if (rc == 0 && timeout_seconds > 0) {
+        timed_group = 0;
+        sigaction(SIGINT, &previous_sigint, NULL);
+        sigaction(SIGTERM, &previous_sigterm, NULL);
+    }
+    sigaction(SIGCHLD, &previous_sigchld, NULL);
+
+    for (int i = 0; i < 3; i++) {
+        if (fds[i].fd >= 0) {
+            close(fds[i].fd);
+        }
+    }
+    close(sigchld_pipe[1]);
+
+    if (rc != 0) {
+        fprintf(stderr, "Failed to run command: %s\n", strerror(rc));
+        return result;
+    }
+    if (exited) {
+        result.exit_status = decode_status(status);
+        result.success = 1;
+    }
+    return result;
+}